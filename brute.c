@@ -14,13 +14,26 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #define inline __attribute__ ((always_inline))
 
@@ -33,10 +46,57 @@ static inline uint32_t SWAP (uint32_t a)
 /* Bits of hash to take.  The hash function we compute collisions for
  * is the first BITS bits of the md5 value.  The program will require
  * around 1<<(BITS/2) md5 operations.  */
+#ifndef BITS
 #define BITS 80
+#endif
 
 /* Proportion out of 1<<32 of results to take.  */
+#ifndef PROPORTION
 #define PROPORTION 16
+#endif
+
+/* The reduction from hash bits to the next message.  The three hash words
+ * are taken as a 12 byte string, and that is encoded most significant bit
+ * first, ENCODE_BITS bits per character, as in RFC 4648.  Truncated bits are
+ * zero.  ENCODE_HEX is what the FPGA (and collate) uses.  Select another
+ * with e.g., -DENCODING=ENCODE_BASE32; each has a vector encoder used by
+ * inline_MD5() and a scalar reference, message_block(), checked at start-up.  */
+#define ENCODE_HEX 0                    /* 0-9a-f.  */
+#define ENCODE_HEX_UPPER 1              /* 0-9A-F.  */
+#define ENCODE_BASE32 2                 /* a-z2-7.  */
+#define ENCODE_BASE64 3                 /* ./0-9A-Za-z, as crypt(3).  */
+
+#ifndef ENCODING
+#define ENCODING ENCODE_HEX
+#endif
+
+#if ENCODING == ENCODE_HEX
+#define ENCODE_BITS 4
+#define ALPHABET "0123456789abcdef"
+#elif ENCODING == ENCODE_HEX_UPPER
+#define ENCODE_BITS 4
+#define ALPHABET "0123456789ABCDEF"
+#elif ENCODING == ENCODE_BASE32
+#define ENCODE_BITS 5
+#define ALPHABET "abcdefghijklmnopqrstuvwxyz234567"
+#elif ENCODING == ENCODE_BASE64
+#define ENCODE_BITS 6
+#define ALPHABET \
+    "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+#else
+#error Huh? Unknown encoding
+#endif
+
+/* Characters in the message; enough for all 96 bits.  The message must
+ * leave room for the padding and length in the one md5 block.  */
+#define MESSAGE_CHARS ((96 + ENCODE_BITS - 1) / ENCODE_BITS)
+#if MESSAGE_CHARS > 55
+#error Message does not fit a block
+#endif
+
+#if ENCODE_BITS > 4 && !defined (__SSSE3__)
+#error Table encodings need pshufb; compile with -mssse3
+#endif
 
 /* When we say inline we mean it --- we're relying heavily on constant
  * folding functions such as word() below.  */
@@ -132,6 +192,7 @@ static value4_t INSERT4 (value4_t v, int index, uint32_t vv)
 
 
 
+#if ENCODE_BITS == 4
 static INLINE void BYTE_INTERLEAVE4 (value4_t * __restrict__ lo,
                                      value4_t * __restrict__ hi)
 {
@@ -200,15 +261,101 @@ static INLINE void BYTE_INTERLEAVE4 (value4_t * __restrict__ lo,
              SWAP (EXTRACT4 (*hi, 2)),
              SWAP (EXTRACT4 (*hi, 3)));
 }
+#endif
+
+#ifdef __SSSE3__
+// Sixteen entries of the alphabet, for pshufb.
+static INLINE value4_t TABLE4 (int t)
+{
+    value4_t table;
+    memcpy (&table, ALPHABET + 16 * t, 16);
+    return table;
+}
 
+
+// Look up each byte of a vector of character indexes in the alphabet.
+static INLINE value4_t LOOKUP4 (value4_t index)
+{
+    value4_t result = (value4_t) __builtin_ia32_pshufb128 (TABLE4 (0), index);
+    // Larger alphabets take a pshufb per sixteen entries, selected on the top
+    // bits of the index.
+    for (int t = 1; t != 1 << (ENCODE_BITS - 4); ++t) {
+        value4_t select = (value4_t) __builtin_ia32_pcmpeqb128 (
+            RIGHT4 (index, 4) & DIAG4 (0x0f0f0f0f), DIAG4 (t * 0x01010101));
+        result = ANDN4 (select, result)
+            | ((value4_t) __builtin_ia32_pshufb128 (TABLE4 (t), index)
+               & select);
+    }
+    return result;
+}
+#endif
+
+
+#if ENCODE_BITS == 4
 // Convert a collection of nibbles to ASCII values.
 static INLINE value4_t ASCIIFY4 (value4_t nibbles)
 {
+#ifdef __SSSE3__
+    return LOOKUP4 (nibbles);
+#else
     value4_t adjust = ((value4_t) __builtin_ia32_pcmpgtb128 (
                           nibbles, DIAG4 (0x09090909)))
-        & DIAG4 (0x27272727);
+        & DIAG4 (ENCODING == ENCODE_HEX ? 0x27272727 : 0x07070707);
     value4_t result = __builtin_ia32_paddb128 (nibbles, DIAG4 (0x30303030));
     return result + adjust;
+#endif
+}
+#endif
+
+
+// Byte b of the 12 byte hash string, in the bottom 8 bits.
+static INLINE value4_t BYTE4 (value4_t D0, value4_t D1, value4_t D2, int b)
+{
+    value4_t w = b < 4 ? D0 : b < 8 ? D1 : D2;
+    if (b >= 12)
+        return DIAG4 (0);
+    return RIGHT4 (w, b % 4 * 8) & DIAG4 (0xff);
+}
+
+
+// Character index j of the message, in the bottom bits.
+static INLINE value4_t FIELD4 (value4_t D0, value4_t D1, value4_t D2, int j)
+{
+    int bit = j * ENCODE_BITS;
+    value4_t pair = LEFT4 (BYTE4 (D0, D1, D2, bit / 8), 8)
+        | BYTE4 (D0, D1, D2, bit / 8 + 1);
+    return RIGHT4 (pair, 16 - ENCODE_BITS - bit % 8)
+        & DIAG4 ((1 << ENCODE_BITS) - 1);
+}
+
+
+// Word w of the md5 block for the message encoding D0, D1, D2; including
+// the padding and length.  Gets constant folded to nothing for most w.
+static INLINE value4_t ENCODE4 (value4_t D0, value4_t D1, value4_t D2, int w)
+{
+    if (w == 14)
+        return DIAG4 (MESSAGE_CHARS * 8);
+
+    value4_t index = DIAG4 (0);
+    uint32_t chars = 0;
+    uint32_t pad = 0;
+    for (int i = 0; i != 4; ++i) {
+        int j = w * 4 + i;
+        if (j < MESSAGE_CHARS) {
+            index |= LEFT4 (FIELD4 (D0, D1, D2, j), i * 8);
+            chars |= 0xff << (i * 8);
+        }
+        else if (j == MESSAGE_CHARS)
+            pad |= 0x80 << (i * 8);
+    }
+    if (chars == 0)
+        return DIAG4 (pad);
+
+#ifdef __SSSE3__
+    return (LOOKUP4 (index) & DIAG4 (chars)) | DIAG4 (pad);
+#else
+    return (ASCIIFY4 (index) & DIAG4 (chars)) | DIAG4 (pad);
+#endif
 }
 
 
@@ -224,6 +371,7 @@ typedef value4_t value_t;
 #define TESTTEST TESTTEST4
 #define EXTRACT EXTRACT4
 #define INSERT INSERT4
+#define ENCODE ENCODE4
 
 #elif WIDTH == 8
 
@@ -291,6 +439,12 @@ static uint32_t EXTRACT (value_t v, int i)
     else
         return EXTRACT4 (v.b, i - 4);
 }
+static INLINE value_t ENCODE (value_t D0, value_t D1, value_t D2, int w)
+{
+    return (value_t) { ENCODE4 (D0.a, D1.a, D2.a, w),
+                       ENCODE4 (D0.b, D1.b, D2.b, w) };
+}
+#if ENCODE_BITS == 4
 static value_t ASCIIFY (value_t v)
 {
     return (value_t) { ASCIIFY4 (v.a), ASCIIFY4 (v.b) };
@@ -301,6 +455,7 @@ static void BYTE_INTERLEAVE (value_t * __restrict__ x,
     BYTE_INTERLEAVE4 (&x->a, &y->a);
     BYTE_INTERLEAVE4 (&x->b, &y->b);
 }
+#endif
 
 #define TESTTEST TESTTEST4
 
@@ -350,6 +505,9 @@ static INLINE value_t ROTATE_LEFT (value_t a, unsigned count)
     return OR (LEFT (a, count), RIGHT (a, 32 - count));
 }
 #endif
+/* The hex encodings split each word of the hash into two of the message;
+ * the others use ENCODE.  */
+#if ENCODE_BITS == 4
 #ifndef EXPAND
 static INLINE void EXPAND (value_t v,
                            value_t * __restrict__ V0,
@@ -383,6 +541,7 @@ static INLINE void EXPAND (value_t v,
 #ifndef SPLIT
 #define SPLIT(v,V0,V1) value_t V0; value_t V1; EXPAND (v, &V0, &V1);
 #endif
+#endif
 
 
 static INLINE value_t TRIM (value_t a, unsigned index)
@@ -449,6 +608,34 @@ static INLINE value_t TRIM (value_t a, unsigned index)
 #define HH(a, b, c, d, x, s, ac) GENERATE (H, a, b, c, d, x, s, ac)
 #define II(a, b, c, d, x, s, ac) GENERATE (I, a, b, c, d, x, s, ac)
 
+/* Declare the words xx00 to xx15 of the md5 block for hash D0, D1, D2.  */
+#if ENCODE_BITS == 4
+#define MESSAGE_HEAD(D0, D1, D2)                \
+    SPLIT (D0, xx00, xx01);                     \
+    SPLIT (D1, xx02, xx03);                     \
+    SPLIT (D2, xx04, xx05);
+#else
+#define MESSAGE_HEAD(D0, D1, D2)                        \
+    const value_t xx00 = ENCODE (D0, D1, D2, 0);        \
+    const value_t xx01 = ENCODE (D0, D1, D2, 1);        \
+    const value_t xx02 = ENCODE (D0, D1, D2, 2);        \
+    const value_t xx03 = ENCODE (D0, D1, D2, 3);        \
+    const value_t xx04 = ENCODE (D0, D1, D2, 4);        \
+    const value_t xx05 = ENCODE (D0, D1, D2, 5);
+#endif
+#define MESSAGE_BLOCK(D0, D1, D2)                       \
+    MESSAGE_HEAD (D0, D1, D2);                          \
+    const value_t xx06 = ENCODE (D0, D1, D2, 6);        \
+    const value_t xx07 = ENCODE (D0, D1, D2, 7);        \
+    const value_t xx08 = ENCODE (D0, D1, D2, 8);        \
+    const value_t xx09 = ENCODE (D0, D1, D2, 9);        \
+    const value_t xx10 = ENCODE (D0, D1, D2, 10);       \
+    const value_t xx11 = ENCODE (D0, D1, D2, 11);       \
+    const value_t xx12 = ENCODE (D0, D1, D2, 12);       \
+    const value_t xx13 = ENCODE (D0, D1, D2, 13);       \
+    const value_t xx14 = ENCODE (D0, D1, D2, 14);       \
+    const value_t xx15 = ENCODE (D0, D1, D2, 15);
+
 /* Generate md5 hash, storing the first 'whole' complete bytes and
  * masking the next byte by 'mask'.  Gets specialised to what we want.  */
 static void INLINE inline_MD5 (value_t * __restrict D0,
@@ -469,47 +656,24 @@ static void INLINE inline_MD5 (value_t * __restrict D0,
     value_t c = init2;
     value_t d = init3;
 
+    MESSAGE_BLOCK (*D0, *D1, *D2);
+
     /* Round 1 */
-    SPLIT (*D0, xx00, xx01);
     FF (a, b, c, d, xx00, S11, 0xd76aa478); /* 1 */
     FF (d, a, b, c, xx01, S12, 0xe8c7b756); /* 2 */
-
-    SPLIT (*D1, xx02, xx03);
     FF (c, d, a, b, xx02, S13, 0x242070db); /* 3 */
     FF (b, c, d, a, xx03, S14, 0xc1bdceee); /* 4 */
-
-    SPLIT (*D2, xx04, xx05);
     FF (a, b, c, d, xx04, S11, 0xf57c0faf); /* 5 */
     FF (d, a, b, c, xx05, S12, 0x4787c62a); /* 6 */
-
-    const value_t xx06 = DIAG (0x80);
     FF (c, d, a, b, xx06, S13, 0xa8304613); /* 7 */
-
-    const value_t xx07 = DIAG (0);
     FF (b, c, d, a, xx07, S14, 0xfd469501); /* 8 */
-
-    const value_t xx08 = DIAG (0);
     FF (a, b, c, d, xx08, S11, 0x698098d8); /* 9 */
-
-    const value_t xx09 = DIAG (0);
     FF (d, a, b, c, xx09, S12, 0x8b44f7af); /* 10 */
-
-    const value_t xx10 = DIAG (0);
     FF (c, d, a, b, xx10, S13, 0xffff5bb1); /* 11 */
-
-    const value_t xx11 = DIAG (0);
     FF (b, c, d, a, xx11, S14, 0x895cd7be); /* 12 */
-
-    const value_t xx12 = DIAG (0);
     FF (a, b, c, d, xx12, S11, 0x6b901122); /* 13 */
-
-    const value_t xx13 = DIAG (0);
     FF (d, a, b, c, xx13, S12, 0xfd987193); /* 14 */
-
-    const value_t xx14 = DIAG (3 * 32 * 2);
     FF (c, d, a, b, xx14, S13, 0xa679438e); /* 15 */
-
-    const value_t xx15 = DIAG (0);
     FF (b, c, d, a, xx15, S14, 0x49b40821); /* 16 */
 
     MD5DEBUG ("BLOCK IS is \n"
@@ -594,6 +758,79 @@ static void outline_MD5 (value_t * v)
 }
 
 
+/* The md5 block for v, for checking against message_block().  */
+static void outline_block (const value_t * v, value_t * xx)
+{
+    MESSAGE_BLOCK (v[0], v[1], v[2]);
+    xx[0] = xx00;
+    xx[1] = xx01;
+    xx[2] = xx02;
+    xx[3] = xx03;
+    xx[4] = xx04;
+    xx[5] = xx05;
+    xx[6] = xx06;
+    xx[7] = xx07;
+    xx[8] = xx08;
+    xx[9] = xx09;
+    xx[10] = xx10;
+    xx[11] = xx11;
+    xx[12] = xx12;
+    xx[13] = xx13;
+    xx[14] = xx14;
+    xx[15] = xx15;
+}
+
+
+/* Scalar reference for the md5 block we hash for the (truncated) hash h.  */
+static void message_block (const uint32_t h[3], uint32_t block[16])
+{
+    unsigned char bytes[64];
+    memset (bytes, 0, sizeof (bytes));
+    for (int j = 0; j != MESSAGE_CHARS; ++j) {
+        int index = 0;
+        for (int i = 0; i != ENCODE_BITS; ++i) {
+            int bit = j * ENCODE_BITS + i;
+            index *= 2;
+            if (bit < 96)
+                index += h[bit / 32] >> (bit % 32 / 8 * 8 + 7 - bit % 8) & 1;
+        }
+        bytes[j] = ALPHABET[index];
+    }
+    bytes[MESSAGE_CHARS] = 0x80;
+
+    for (int i = 0; i != 16; ++i)
+        block[i] = bytes[i * 4] + bytes[i * 4 + 1] * 256
+            + bytes[i * 4 + 2] * 65536 + bytes[i * 4 + 3] * 16777216u;
+    block[14] = MESSAGE_CHARS * 8;
+}
+
+
+/* Check the vector encoding against the scalar one.  */
+static void check_encoding (void)
+{
+    for (int n = 0; n != 1000; ++n) {
+        value_t v[3];
+        uint32_t h[3][WIDTH];
+        for (int i = 0; i != 3; ++i) {
+            v[i] = DIAG (0);
+            for (int j = 0; j != WIDTH; ++j) {
+                h[i][j] = random() ^ random() << 16;
+                v[i] = INSERT (v[i], j, h[i][j]);
+            }
+        }
+
+        value_t xx[16];
+        outline_block (v, xx);
+        for (int j = 0; j != WIDTH; ++j) {
+            uint32_t block[16];
+            message_block ((uint32_t[3]) { h[0][j], h[1][j], h[2][j] }, block);
+            for (int i = 0; i != 16; ++i)
+                assert (EXTRACT (xx[i], j) == block[i]);
+        }
+    }
+}
+
+
 static int loop_MD5 (value_t * __restrict__ v,
                      uint64_t * __restrict__ iterations)
 {
@@ -617,6 +854,13 @@ static int loop_MD5 (value_t * __restrict__ v,
 
 static uint64_t work_block = 1;
 static uint64_t work_step = 1;
+// The end of the current range of blocks, for a worker.
+static uint64_t work_end;
+// The worker's connection to the coordinator.
+static int worker_socket = -1;
+static void worker_exchange (void);
+// Held while storing points and recharging, which includes worker_exchange().
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 // (Re)initialise slice given by index.
 static void recharge (value_t * v,
@@ -625,6 +869,8 @@ static void recharge (value_t * v,
                       uint64_t iteration,
                       int index)
 {
+    if (worker_socket >= 0 && work_block >= work_end)
+        worker_exchange();
     uint64_t block = work_block;
     work_block += work_step;
     v[0] = INSERT (v[0], index, block);
@@ -740,6 +986,942 @@ static void collision (const record_t * A,
     abort();
 }
 
+
+/************************* Shared table.  **************************/
+
+/* With -s, distinguished points go in a table in a named POSIX shared memory
+ * segment instead of record_table, so that brute processes on one host (with
+ * different block/step arguments) find collisions between each other's
+ * chains.  The table is open addressed; slots are claimed by compare and swap
+ * and never removed, so processes start and stop independently.  Whoever
+ * inserts the second of a colliding pair does the collision work.
+ *
+ * A slot being filled in, and the magic while the table is set up, hold the
+ * pid of the process doing it (plus SLOT_CLAIMED, as pid 1 is possible), so
+ * that others can take over from a process that died halfway.  */
+
+#define SHARED_SLOTS (1 << 20)
+#define SHARED_MAGIC 0x326574757262ul   // "brute2"
+
+enum {
+    SLOT_EMPTY,
+    SLOT_FULL,
+    SLOT_CLAIMED,                       // Plus the pid.
+};
+
+typedef struct shared_slot_t {
+    uint32_t state;
+    uint32_t h[3];
+    uint64_t block;
+    uint64_t iterations;
+} shared_slot_t;
+
+typedef struct shared_table_t {
+    uint64_t magic;
+    uint32_t bits;
+    uint32_t proportion;
+    uint32_t encoding;
+    uint32_t slots;
+    uint64_t count;
+    uint64_t iterations;                // Total over all processes.
+    shared_slot_t slot[];
+} shared_table_t;
+
+static shared_table_t * shared_table;
+
+
+// Whether the process that claimed with claim has gone.
+static bool claim_dead (uint64_t claim)
+{
+    return kill (claim - SLOT_CLAIMED, 0) < 0 && errno == ESRCH;
+}
+
+
+static void open_shared (const char * name)
+{
+    int fd = shm_open (name, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        perror (name);
+        exit (EXIT_FAILURE);
+    }
+
+    // New segments are zero filled, so the table is empty.
+    size_t size = sizeof (shared_table_t)
+        + SHARED_SLOTS * sizeof (shared_slot_t);
+    struct stat st;
+    if (fstat (fd, &st) < 0
+        || (st.st_size < size && ftruncate (fd, size) < 0)) {
+        perror (name);
+        exit (EXIT_FAILURE);
+    }
+
+    shared_table = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared_table == MAP_FAILED) {
+        perror ("mmap");
+        exit (EXIT_FAILURE);
+    }
+    close (fd);
+
+    // Set up the table if it is new, or its creator died doing so; give up
+    // after ten seconds, in case the creator's pid got reused.
+    uint64_t claim = SLOT_CLAIMED + getpid();
+    uint64_t expect = 0;
+    for (int i = 0; ; ++i) {
+        if (__sync_bool_compare_and_swap (&shared_table->magic, expect, claim)) {
+            shared_table->bits = BITS;
+            shared_table->proportion = PROPORTION;
+            shared_table->encoding = ENCODING;
+            shared_table->slots = SHARED_SLOTS;
+            __atomic_store_n (&shared_table->magic, SHARED_MAGIC,
+                              __ATOMIC_RELEASE);
+        }
+        uint64_t magic = __atomic_load_n (&shared_table->magic,
+                                          __ATOMIC_ACQUIRE);
+        if (magic == SHARED_MAGIC)
+            break;
+        if (magic < SLOT_CLAIMED || magic - SLOT_CLAIMED > INT32_MAX) {
+            fprintf (stderr, "%s is not a brute table\n", name);
+            exit (EXIT_FAILURE);
+        }
+        if (i == 10000) {
+            fprintf (stderr, "%s is stuck being set up by pid %lu\n",
+                     name, magic - SLOT_CLAIMED);
+            exit (EXIT_FAILURE);
+        }
+        expect = claim_dead (magic) ? magic : 0;
+        if (expect == 0)
+            usleep (1000);
+    }
+
+    if (shared_table->bits != BITS || shared_table->proportion != PROPORTION
+        || shared_table->encoding != ENCODING
+        || shared_table->slots != SHARED_SLOTS) {
+        fprintf (stderr, "%s is for BITS=%u PROPORTION=%u ENCODING=%u\n",
+                 name, shared_table->bits, shared_table->proportion,
+                 shared_table->encoding);
+        exit (EXIT_FAILURE);
+    }
+
+    printf ("Shared table %s has %lu points, %lu iterations\n", name,
+            shared_table->count, shared_table->iterations);
+    fflush (NULL);
+}
+
+
+static void shared_store (const record_t * record)
+{
+    __sync_fetch_and_add (&shared_table->iterations, record->iterations);
+
+    uint32_t claim = SLOT_CLAIMED + getpid();
+    uint32_t hash = record->h[0] ^ record->h[1] ^ record->h[2];
+    for (uint32_t n = 0; n != SHARED_SLOTS; ++n) {
+        shared_slot_t * s = &shared_table->slot[(hash + n) % SHARED_SLOTS];
+        uint32_t state = __atomic_load_n (&s->state, __ATOMIC_ACQUIRE);
+
+        // A claim is filled in straight away, so wait for it, lest the
+        // claimer is storing the same point; take over the slot only if the
+        // claimer died.
+        while (state != SLOT_FULL) {
+            if (state == SLOT_EMPTY) {
+                if (__sync_bool_compare_and_swap (&s->state, state, claim)) {
+                    memcpy (s->h, record->h, sizeof (s->h));
+                    s->block = record->block;
+                    s->iterations = record->iterations;
+                    __atomic_store_n (&s->state, SLOT_FULL, __ATOMIC_RELEASE);
+                    __sync_fetch_and_add (&shared_table->count, 1);
+                    return;
+                }
+            }
+            else if (claim_dead (state))
+                __sync_bool_compare_and_swap (&s->state, state, SLOT_EMPTY);
+            else
+                sched_yield();
+            state = __atomic_load_n (&s->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (s->h[0] == record->h[0]
+            && s->h[1] == record->h[1] && s->h[2] == record->h[2]) {
+            // The same chain again, from a restarted process.
+            if (s->block == record->block
+                && s->iterations == record->iterations)
+                return;
+            record_t other;
+            memcpy (other.h, s->h, sizeof (other.h));
+            other.block = s->block;
+            other.iterations = s->iterations;
+            collision (&other, record);
+        }
+    }
+
+    fprintf (stderr, "Shared table full\n");
+    exit (EXIT_FAILURE);
+}
+
+
+/************************* Spilling to disk.  **************************/
+
+/* With brute -d <directory>, once the in-memory table holds the limit (-m) of
+ * records, it is written out as a run sorted on the hash, and emptied.  A
+ * background thread merges runs of similar size together, RUN_FANIN at a time,
+ * finding equal end points in different runs and handing them to the thread
+ * storing records, for collision(); so each record gets rewritten about
+ * log(total / limit) times, rather than at every spill.  Runs of different
+ * sizes meet only in a merge of everything, once the total has grown RUN_FANIN
+ * fold since the last, so a collision with a record on disk is noticed by when
+ * the total has grown at most that much; those merges write about 4/3 of the
+ * total in all.  Runs are written under a temporary name and renamed
+ * once complete, and runs left in the directory by an earlier process are
+ * taken up, with the numbering carrying on after them.  */
+
+typedef struct run_record_t {
+    uint32_t h[3];
+    uint32_t unused;
+    uint64_t block;
+    uint64_t iterations;
+} run_record_t;
+
+static const char * spill_directory;
+static uint64_t spill_limit = 1 << 24;
+static uint64_t spill_count;            // Records in memory.
+
+// Runs waiting to be merged, and the next run number, under runs_lock.
+#define RUN_FANIN 4
+#define MAX_RUNS 64
+typedef struct run_t {
+    unsigned number;
+    uint64_t count;
+} run_t;
+static run_t runs[MAX_RUNS];
+static int run_count;
+static unsigned run_number;
+// Records in the last merge of all the runs.
+static uint64_t merged_total;
+// A collision found by the merger, until the storing thread runs it.
+static run_record_t merged_pair[2];
+static bool merged_pending;
+static pthread_mutex_t runs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t runs_cond = PTHREAD_COND_INITIALIZER;
+
+
+static int run_compare (const void * AA, const void * BB)
+{
+    const run_record_t * A = AA;
+    const run_record_t * B = BB;
+    for (int i = 0; i != 3; ++i)
+        if (A->h[i] != B->h[i])
+            return A->h[i] < B->h[i] ? -1 : 1;
+    return 0;
+}
+
+
+// The path of a run, or of the temporary it is written to.
+static char * run_path (unsigned number, bool temporary)
+{
+    char * path = malloc (strlen (spill_directory) + 24);
+    sprintf (path, "%s/run-%06u%s", spill_directory, number,
+             temporary ? ".new" : "");
+    return path;
+}
+
+
+// Open a run, to write under the temporary name with mode "w".
+static FILE * open_run (unsigned number, const char * mode)
+{
+    char * path = run_path (number, mode[0] == 'w');
+    FILE * f = fopen (path, mode);
+    if (f == NULL) {
+        perror (path);
+        exit (EXIT_FAILURE);
+    }
+    free (path);
+    setvbuf (f, NULL, _IOFBF, 1 << 20);
+    return f;
+}
+
+
+// Close a run being written, and give it its real name.
+static void finish_run (FILE * f, unsigned number)
+{
+    char * temporary = run_path (number, true);
+    char * path = run_path (number, false);
+    if (fclose (f) != 0 || rename (temporary, path) < 0) {
+        perror (path);
+        exit (EXIT_FAILURE);
+    }
+    free (temporary);
+    free (path);
+}
+
+
+static void remove_run (unsigned number)
+{
+    char * path = run_path (number, false);
+    unlink (path);
+    free (path);
+}
+
+
+// Which size tier a run is in; runs are only merged with others in the same.
+static int run_tier (uint64_t count)
+{
+    uint64_t limit = spill_limit ? spill_limit : 1;
+    int tier = 0;
+    for (; count >= limit * RUN_FANIN && tier != MAX_RUNS - 1; ++tier)
+        count /= RUN_FANIN;
+    return tier;
+}
+
+
+/* The lowest tier with RUN_FANIN runs waiting; else ALL_TIERS once the total
+ * has grown RUN_FANIN fold since the last merge of everything; else -1.  Call
+ * with runs_lock.  */
+#define ALL_TIERS MAX_RUNS
+static int merge_tier (void)
+{
+    int in_tier[MAX_RUNS] = { 0 };
+    uint64_t total = 0;
+    for (int i = 0; i != run_count; ++i) {
+        ++in_tier[run_tier (runs[i].count)];
+        total += runs[i].count;
+    }
+    for (int t = 0; t != MAX_RUNS; ++t)
+        if (in_tier[t] >= RUN_FANIN)
+            return t;
+    uint64_t base = merged_total > spill_limit ? merged_total : spill_limit;
+    if (run_count > 1 && total >= base * RUN_FANIN)
+        return ALL_TIERS;
+    return -1;
+}
+
+
+static void run_collision (const run_record_t * A, const run_record_t * B);
+
+/* Run a collision the merger found, as collision() may exit, which should not
+ * happen under the storing thread's feet.  Call with runs_lock, which is
+ * dropped meanwhile.  */
+static void merged_collision (void)
+{
+    if (!merged_pending)
+        return;
+    run_record_t pair[2] = { merged_pair[0], merged_pair[1] };
+    pthread_mutex_unlock (&runs_lock);
+    run_collision (&pair[0], &pair[1]);
+    pthread_mutex_lock (&runs_lock);
+    merged_pending = false;
+    pthread_cond_broadcast (&runs_cond);
+}
+
+
+static void add_run (unsigned number, uint64_t count)
+{
+    pthread_mutex_lock (&runs_lock);
+    while (run_count == MAX_RUNS || merged_pending) {
+        merged_collision();
+        if (run_count == MAX_RUNS)      // Wait for the merger to catch up.
+            pthread_cond_wait (&runs_cond, &runs_lock);
+    }
+    runs[run_count++] = (run_t) { number, count };
+    pthread_cond_broadcast (&runs_cond);
+    pthread_mutex_unlock (&runs_lock);
+}
+
+
+static void write_run_record (FILE * f, const run_record_t * r)
+{
+    if (fwrite (r, sizeof (run_record_t), 1, f) != 1) {
+        perror ("write run");
+        exit (EXIT_FAILURE);
+    }
+}
+
+
+// Write out and empty the in-memory table.
+static void spill (void)
+{
+    run_record_t * records = malloc (spill_count * sizeof (run_record_t));
+    if (records == NULL) {
+        fprintf (stderr, "Out of memory for spill\n");
+        exit (EXIT_FAILURE);
+    }
+    uint64_t n = 0;
+    for (int i = 0; i != TABLE_SIZE; ++i) {
+        record_t * next;
+        for (record_t * p = record_table[i]; p; p = next) {
+            memcpy (records[n].h, p->h, sizeof (p->h));
+            records[n].unused = 0;
+            records[n].block = p->block;
+            records[n].iterations = p->iterations;
+            ++n;
+            next = p->next;
+            free (p);
+        }
+        record_table[i] = NULL;
+    }
+    assert (n == spill_count);
+    qsort (records, n, sizeof (run_record_t), run_compare);
+
+    pthread_mutex_lock (&runs_lock);
+    unsigned number = run_number++;
+    pthread_mutex_unlock (&runs_lock);
+    FILE * f = open_run (number, "w");
+    for (uint64_t i = 0; i != n; ++i)
+        write_run_record (f, &records[i]);
+    finish_run (f, number);
+    free (records);
+    spill_count = 0;
+
+    printf ("Spilled %lu records to run %u\n", n, number);
+    fflush (NULL);
+    add_run (number, n);
+}
+
+
+static void run_collision (const run_record_t * A, const run_record_t * B)
+{
+    record_t a = { .block = A->block, .iterations = A->iterations };
+    record_t b = { .block = B->block, .iterations = B->iterations };
+    memcpy (a.h, A->h, sizeof (a.h));
+    memcpy (b.h, B->h, sizeof (b.h));
+    collision (&a, &b);
+}
+
+
+/* Hand a collision to the storing thread, and wait until it has been run, so
+ * that the merger is idle if collision() exits.  */
+static void merger_collision (const run_record_t * A, const run_record_t * B)
+{
+    pthread_mutex_lock (&runs_lock);
+    merged_pair[0] = *A;
+    merged_pair[1] = *B;
+    merged_pending = true;
+    pthread_cond_broadcast (&runs_cond);
+    while (merged_pending)
+        pthread_cond_wait (&runs_cond, &runs_lock);
+    pthread_mutex_unlock (&runs_lock);
+}
+
+
+/* Merge runs of the same tier, or all of them, into one new run, dropping
+ * (after passing them to collision()) records that repeat an end point.  The
+ * same chain twice, from a restarted process, is just dropped.  */
+static void * merger (void * ignore)
+{
+    pthread_mutex_lock (&runs_lock);
+    while (true) {
+        int tier;
+        while ((tier = merge_tier()) < 0)
+            pthread_cond_wait (&runs_cond, &runs_lock);
+
+        run_t inputs[MAX_RUNS];
+        int n = 0;
+        for (int i = 0; i != run_count; )
+            if (tier == ALL_TIERS || run_tier (runs[i].count) == tier) {
+                inputs[n++] = runs[i];
+                runs[i] = runs[--run_count];
+            }
+            else
+                ++i;
+        unsigned number = run_number++;
+        pthread_cond_broadcast (&runs_cond);
+        pthread_mutex_unlock (&runs_lock);
+
+        FILE * in[n];
+        run_record_t head[n];
+        bool live[n];
+        for (int i = 0; i != n; ++i) {
+            in[i] = open_run (inputs[i].number, "r");
+            live[i] = fread (&head[i], sizeof (run_record_t), 1, in[i]) == 1;
+        }
+
+        FILE * out = open_run (number, "w");
+        run_record_t last = { { 0 } };
+        uint64_t count = 0;
+        while (true) {
+            int j = -1;
+            for (int i = 0; i != n; ++i)
+                if (live[i] && (j < 0 || run_compare (&head[i], &head[j]) < 0))
+                    j = i;
+            if (j < 0)
+                break;
+
+            if (count != 0 && run_compare (&last, &head[j]) == 0) {
+                if (last.block != head[j].block
+                    || last.iterations != head[j].iterations)
+                    merger_collision (&last, &head[j]);
+            }
+            else {
+                write_run_record (out, &head[j]);
+                last = head[j];
+                ++count;
+            }
+            live[j] = fread (&head[j], sizeof (run_record_t), 1, in[j]) == 1;
+        }
+
+        finish_run (out, number);
+        for (int i = 0; i != n; ++i) {
+            fclose (in[i]);
+            remove_run (inputs[i].number);
+        }
+        printf ("Merged %i runs into run %u, %lu records\n", n, number, count);
+        fflush (NULL);
+
+        pthread_mutex_lock (&runs_lock);
+        runs[run_count++] = (run_t) { number, count };
+        if (tier == ALL_TIERS)
+            merged_total = count;
+    }
+    return NULL;
+}
+
+
+// Take up the runs already in the directory, and drop unfinished ones.
+static void find_runs (void)
+{
+    DIR * dir = opendir (spill_directory);
+    if (dir == NULL) {
+        perror (spill_directory);
+        exit (EXIT_FAILURE);
+    }
+    const struct dirent * e;
+    while ((e = readdir (dir)) != NULL) {
+        unsigned number;
+        char end[5];
+        int fields = sscanf (e->d_name, "run-%6u%4s", &number, end);
+        if (fields < 1 || (fields == 2 && strcmp (end, ".new") != 0))
+            continue;
+        char * path = run_path (number, fields == 2);
+        struct stat st;
+        if (fields == 2)
+            unlink (path);
+        else if (stat (path, &st) < 0)
+            perror (path);
+        else if (run_count == MAX_RUNS) {
+            fprintf (stderr, "Too many runs in %s\n", spill_directory);
+            exit (EXIT_FAILURE);
+        }
+        else {
+            runs[run_count++] = (run_t) {
+                number, st.st_size / sizeof (run_record_t) };
+            if (number >= run_number)
+                run_number = number + 1;
+        }
+        free (path);
+    }
+    closedir (dir);
+
+    if (run_count != 0) {
+        printf ("Taking up %i runs in %s\n", run_count, spill_directory);
+        fflush (NULL);
+    }
+}
+
+
+static void start_spill (const char * directory)
+{
+    spill_directory = directory;
+    if (mkdir (directory, 0777) < 0 && errno != EEXIST) {
+        perror (directory);
+        exit (EXIT_FAILURE);
+    }
+    find_runs();
+    pthread_t th;
+    if (pthread_create (&th, NULL, merger, NULL) != 0) {
+        fprintf (stderr, "Failed to start merger\n");
+        exit (EXIT_FAILURE);
+    }
+}
+
+
+/************************* Coordinator and workers.  **************************/
+
+/* brute -c <address> is a coordinator: it hands out ranges of start blocks to
+ * workers, brute -w <address>, which send back their distinguished points in
+ * batches, when full or once a second.  The coordinator keeps the table and
+ * does the collision search; once that succeeds it tells the workers to stop,
+ * and waits for them to hang up.  An address containing a '/' is a unix
+ * socket, otherwise it is [host]:port.  test-brute.sh runs one on localhost.
+ */
+
+static void insert_record (record_t * record);
+
+#define NET_BATCH 64                    // Records per batch.
+#define NET_RANGE (1 << 20)             // Blocks per range.
+
+typedef struct net_record_t {
+    uint32_t h[3];
+    uint32_t unused;
+    uint64_t block;
+    uint64_t iterations;
+} net_record_t;
+
+// Worker to coordinator: a header followed by count records.
+typedef struct net_batch_t {
+    uint32_t count;
+    uint32_t want_range;
+} net_batch_t;
+
+// Coordinator to worker, in reply to each batch, or unsolicited to stop.
+typedef struct net_reply_t {
+    uint32_t stop;
+    uint32_t unused;
+    uint64_t range_start;
+    uint64_t range_count;
+} net_reply_t;
+
+static net_record_t worker_batch[NET_BATCH];
+static int worker_batch_count;
+
+typedef struct client_t {
+    int fd;
+    size_t fill;
+    union {
+        net_batch_t batch;
+        unsigned char buf[sizeof (net_batch_t)
+                          + NET_BATCH * sizeof (net_record_t)];
+    };
+} client_t;
+
+static client_t * clients;
+static int client_count;
+static void drop_client (int i);
+
+
+static int net_socket (const char * address, bool server)
+{
+    int fd = -1;
+    if (strchr (address, '/') != NULL) {
+        struct sockaddr_un sun;
+        if (strlen (address) >= sizeof (sun.sun_path)) {
+            fprintf (stderr, "Socket path %s too long\n", address);
+            exit (EXIT_FAILURE);
+        }
+        memset (&sun, 0, sizeof (sun));
+        sun.sun_family = AF_UNIX;
+        strcpy (sun.sun_path, address);
+
+        fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror ("socket");
+            exit (EXIT_FAILURE);
+        }
+        if (server) {
+            unlink (address);
+            if (bind (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0
+                || listen (fd, 64) < 0) {
+                perror (address);
+                exit (EXIT_FAILURE);
+            }
+        }
+        else if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0) {
+            perror (address);
+            exit (EXIT_FAILURE);
+        }
+        return fd;
+    }
+
+    const char * colon = strrchr (address, ':');
+    if (colon == NULL) {
+        fprintf (stderr, "Address %s is neither [host]:port nor a path\n",
+                 address);
+        exit (EXIT_FAILURE);
+    }
+    char host[colon - address + 1];
+    memcpy (host, address, colon - address);
+    host[colon - address] = 0;
+
+    struct addrinfo hints;
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    struct addrinfo * ai;
+    int r = getaddrinfo (host[0] ? host : NULL, colon + 1, &hints, &ai);
+    if (r != 0) {
+        fprintf (stderr, "%s: %s\n", address, gai_strerror (r));
+        exit (EXIT_FAILURE);
+    }
+
+    for (const struct addrinfo * a = ai; a; a = a->ai_next) {
+        fd = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (server) {
+            int one = 1;
+            setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+            if (bind (fd, a->ai_addr, a->ai_addrlen) == 0
+                && listen (fd, 64) == 0)
+                break;
+        }
+        else if (connect (fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (ai);
+    if (fd < 0) {
+        perror (address);
+        exit (EXIT_FAILURE);
+    }
+    return fd;
+}
+
+
+static bool write_all (int fd, const void * p, size_t len)
+{
+    while (len > 0) {
+        ssize_t r = write (fd, p, len);
+        if (r <= 0)
+            return false;
+        p = (const char *) p + r;
+        len -= r;
+    }
+    return true;
+}
+
+
+static bool read_all (int fd, void * p, size_t len)
+{
+    while (len > 0) {
+        ssize_t r = read (fd, p, len);
+        if (r <= 0)
+            return false;
+        p = (char *) p + r;
+        len -= r;
+    }
+    return true;
+}
+
+
+/* Send the batch, and get a new range if we have used up the current one.
+ * A stop, or losing the coordinator, stops us.  Called with lock held.  */
+static void worker_exchange (void)
+{
+    net_batch_t batch;
+    batch.count = worker_batch_count;
+    batch.want_range = work_block >= work_end;
+    bool sent = write_all (worker_socket, &batch, sizeof (batch))
+        && write_all (worker_socket, worker_batch,
+                      worker_batch_count * sizeof (net_record_t));
+    // Read even if the send failed, as there may be a stop waiting.
+    net_reply_t reply;
+    if (!read_all (worker_socket, &reply, sizeof (reply))
+        || (!sent && !reply.stop)) {
+        printf ("Lost coordinator\n");
+        exit (EXIT_FAILURE);
+    }
+    if (reply.stop) {
+        printf ("Stopped by coordinator\n");
+        exit (EXIT_SUCCESS);
+    }
+    if (reply.range_count != 0) {
+        work_block = reply.range_start;
+        work_step = 1;
+        work_end = reply.range_start + reply.range_count;
+    }
+    worker_batch_count = 0;
+}
+
+
+static void worker_store (const record_t * record)
+{
+    net_record_t * r = &worker_batch[worker_batch_count++];
+    memcpy (r->h, record->h, sizeof (r->h));
+    r->unused = 0;
+    r->block = record->block;
+    r->iterations = record->iterations;
+    if (worker_batch_count == NET_BATCH)
+        worker_exchange();
+}
+
+
+// Send what there is once a second, however slowly points turn up.
+static void * worker_flusher (void * ignore)
+{
+    while (true) {
+        sleep (1);
+        pthread_mutex_lock (&lock);
+        if (worker_batch_count != 0)
+            worker_exchange();
+        pthread_mutex_unlock (&lock);
+    }
+    return NULL;
+}
+
+
+static void open_worker (const char * address)
+{
+    signal (SIGPIPE, SIG_IGN);
+    worker_socket = net_socket (address, false);
+    work_end = 0;
+    worker_exchange();
+    printf ("Worker starting at block %lu\n", work_block);
+    fflush (NULL);
+
+    pthread_t th;
+    if (pthread_create (&th, NULL, worker_flusher, NULL) != 0) {
+        fprintf (stderr, "Failed to start flusher\n");
+        exit (EXIT_FAILURE);
+    }
+}
+
+
+static void reply_client (client_t * c, bool stop, bool range)
+{
+    net_reply_t reply;
+    memset (&reply, 0, sizeof (reply));
+    reply.stop = stop;
+    if (range) {
+        reply.range_start = work_block;
+        reply.range_count = NET_RANGE;
+        work_block += NET_RANGE;
+    }
+    if (!write_all (c->fd, &reply, sizeof (reply)))
+        fprintf (stderr, "Failed to reply to worker %i\n", c->fd);
+}
+
+
+/* On exit, after a collision, tell all the workers to stop.  Then read (and
+ * drop) whatever they send until they hang up, for up to STOP_WAIT seconds,
+ * as closing with their batches unread would reset the connections, maybe
+ * before they see the stop.  clients belongs to the coordinator's thread, so
+ * an exit from another (the spill merger failing) just drops the workers.  */
+#define STOP_WAIT 5
+static pthread_t coordinator_thread;
+static void stop_clients (void)
+{
+    if (!pthread_equal (pthread_self(), coordinator_thread))
+        return;
+    for (int i = 0; i != client_count; ++i) {
+        reply_client (&clients[i], true, false);
+        shutdown (clients[i].fd, SHUT_WR);
+    }
+
+    time_t deadline = time (NULL) + STOP_WAIT;
+    while (client_count != 0 && time (NULL) < deadline) {
+        struct pollfd fds[client_count];
+        for (int i = 0; i != client_count; ++i) {
+            fds[i].fd = clients[i].fd;
+            fds[i].events = POLLIN;
+        }
+        int n = client_count;
+        if (poll (fds, n, 1000) < 0)
+            break;
+        for (int i = n - 1; i >= 0; --i) {
+            char buf[4096];
+            if (fds[i].revents && read (fds[i].fd, buf, sizeof (buf)) <= 0)
+                drop_client (i);
+        }
+    }
+}
+
+
+static void client_batch (client_t * c)
+{
+    const net_record_t * records = (const net_record_t *) (&c->batch + 1);
+    for (uint32_t i = 0; i != c->batch.count; ++i) {
+        record_t * record = malloc (sizeof (record_t));
+        memcpy (record->h, records[i].h, sizeof (record->h));
+        record->block = records[i].block;
+        record->iterations = records[i].iterations;
+        recorded_iterations += record->iterations;
+        printf ("%08x %08x -%10lu - %08x %08x %08x [%lu] %i\n",
+                SWAP (record->block), SWAP (record->block >> 32),
+                record->iterations,
+                SWAP (record->h[0]), SWAP (record->h[1]), SWAP (record->h[2]),
+                recorded_iterations, c->fd);
+        fflush (NULL);
+        insert_record (record);
+    }
+    reply_client (c, false, c->batch.want_range);
+}
+
+
+static void drop_client (int i)
+{
+    printf ("Worker %i gone\n", clients[i].fd);
+    close (clients[i].fd);
+    clients[i] = clients[--client_count];
+}
+
+
+// Read from a client, and process the batch once it is complete.
+static void client_read (int i)
+{
+    client_t * c = &clients[i];
+    size_t want = sizeof (net_batch_t);
+    if (c->fill >= want) {
+        if (c->batch.count > NET_BATCH) {
+            fprintf (stderr, "Worker %i sent bogus batch\n", c->fd);
+            drop_client (i);
+            return;
+        }
+        want += c->batch.count * sizeof (net_record_t);
+    }
+
+    ssize_t r = read (c->fd, c->buf + c->fill, want - c->fill);
+    if (r <= 0) {
+        drop_client (i);
+        return;
+    }
+    c->fill += r;
+    if (c->fill < want)
+        return;
+    if (want == sizeof (net_batch_t) && c->batch.count != 0)
+        return;                         // Now read the records.
+
+    c->fill = 0;
+    client_batch (c);
+}
+
+
+static void coordinator (const char * address) __attribute__ ((noreturn));
+static void coordinator (const char * address)
+{
+    signal (SIGPIPE, SIG_IGN);
+    int listener = net_socket (address, true);
+    coordinator_thread = pthread_self();
+    atexit (stop_clients);
+    printf ("Coordinator on %s, starting at block %lu\n", address, work_block);
+    fflush (NULL);
+
+    while (true) {
+        struct pollfd fds[client_count + 1];
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (int i = 0; i != client_count; ++i) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        int n = client_count;
+        if (poll (fds, n + 1, -1) < 0) {
+            perror ("poll");
+            exit (EXIT_FAILURE);
+        }
+
+        // Backwards, as drop_client() moves the last client down.
+        for (int i = n - 1; i >= 0; --i)
+            if (fds[i + 1].revents)
+                client_read (i);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept (listener, NULL, NULL);
+            if (fd < 0) {
+                perror ("accept");
+                continue;
+            }
+            clients = realloc (clients, (client_count + 1) * sizeof (client_t));
+            if (clients == NULL) {
+                fprintf (stderr, "Out of memory for workers\n");
+                exit (EXIT_FAILURE);
+            }
+            clients[client_count].fd = fd;
+            clients[client_count].fill = 0;
+            ++client_count;
+            printf ("Worker %i connected\n", fd);
+            fflush (NULL);
+        }
+    }
+}
+
 static __thread struct timeval last_time;
 static __thread uint64_t last_iters;
 
@@ -755,6 +1937,8 @@ static void store (value_t * v,
     milliseconds *= 1000000;
     milliseconds += current_time.tv_usec - last_time.tv_usec;
     milliseconds /= 1000;
+    if (milliseconds == 0)
+        milliseconds = 1;
 
     record_t * record = malloc (sizeof (record_t));
     record->h[0] = EXTRACT (v[0], index);
@@ -774,6 +1958,26 @@ static void store (value_t * v,
     last_time = current_time;
     last_iters = iteration;
 
+    if (worker_socket >= 0) {
+        worker_store (record);          // The coordinator keeps the table.
+        free (record);
+        return;
+    }
+
+    insert_record (record);
+}
+
+
+/* Add a record to the table (of whichever sort), taking ownership, and
+ * running the collision search on a match.  */
+static void insert_record (record_t * record)
+{
+    if (shared_table != NULL) {
+        shared_store (record);
+        free (record);
+        return;
+    }
+
     uint32_t hash = record->h[0] ^ record->h[1] ^ record->h[2];
     hash %= TABLE_SIZE;
 
@@ -785,9 +1989,15 @@ static void store (value_t * v,
 
     record->next = record_table[hash];
     record_table[hash] = record;
-}
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    if (spill_directory == NULL)
+        return;
+    pthread_mutex_lock (&runs_lock);
+    merged_collision();
+    pthread_mutex_unlock (&runs_lock);
+    if (++spill_count >= spill_limit)
+        spill();
+}
 
 static void main_loop (void * ignore) __attribute__ ((__noreturn__));
 static void main_loop (void * ignore)
@@ -819,12 +2029,431 @@ static void main_loop (void * ignore)
 }
 
 
+/************************* Rainbow tables.  **************************/
+
+/* A table of chains ending at distinguished points, for finding preimages
+ * rather than collisions.  The reduction varies with the column: the column
+ * number (the count of md5 operations so far) is xor'd into the third word
+ * before each hash, outside the truncated bits unless BITS > 64.  So chains
+ * that meet in different columns do not merge, and a lookup walks from the
+ * target to a distinguished point once for each possible column; the SIMD
+ * lanes take different columns.  Only sensible for small BITS and large
+ * PROPORTION.  */
+
+/* Chains longer than this are discarded, and lookups try this many
+ * columns.  */
+#define MAX_CHAIN (8 * (0x100000000 / PROPORTION))
+#if MAX_CHAIN >= 0x100000000
+#error PROPORTION too small for a rainbow table
+#endif
+
+typedef struct chain_t {
+    uint32_t h[3];                      // End point.
+    uint32_t length;
+    uint64_t block;                     // Start point.
+} chain_t;
+
+typedef struct table_header_t {
+    char magic[8];
+    uint32_t bits;
+    uint32_t proportion;
+    uint32_t encoding;
+    uint32_t max_chain;
+    uint64_t count;
+} table_header_t;
+
+static const char table_magic[8] = "brutetb1";
+
+
+static bool distinguished (uint32_t h0)
+{
+    // As per TEST4.
+    return h0 - 0x80000000 < PROPORTION;
+}
+
+
+static int endpoint_compare (const uint32_t A[3], const uint32_t B[3])
+{
+    for (int i = 0; i != 3; ++i)
+        if (A[i] != B[i])
+            return A[i] < B[i] ? -1 : 1;
+    return 0;
+}
+
+
+// Order by end point, then length.
+static int chain_compare (const void * AA, const void * BB)
+{
+    const chain_t * A = AA;
+    const chain_t * B = BB;
+    int c = endpoint_compare (A->h, B->h);
+    if (c != 0)
+        return c;
+    if (A->length != B->length)
+        return A->length < B->length ? -1 : 1;
+    return 0;
+}
+
+
+/* As loop_MD5, but with the column xor'd in.  Returns with the lanes that
+ * hit holding the distinguished point; the caller applies the xor to v[2]
+ * after dealing with them.  */
+static int loop_table (value_t * __restrict__ v,
+                       value_t * __restrict__ column)
+{
+    value_t A = v[0];
+    value_t B = v[1];
+    value_t C = v[2];
+    value_t COL = *column;
+    int t;
+
+    while (true) {
+        inline_MD5 (&A, &B, &C);
+        COL = ADD (COL, DIAG (1));
+        t = TEST (A);
+        if (__builtin_expect (t != 0, 0))
+            break;
+        C = XOR (C, COL);
+    }
+    v[0] = A;
+    v[1] = B;
+    v[2] = C;
+    *column = COL;
+    return t;
+}
+
+
+static void build_table (const char * path, uint64_t count)
+{
+    FILE * f = fopen (path, "w");
+    if (f == NULL) {
+        perror (path);
+        exit (EXIT_FAILURE);
+    }
+
+    chain_t * chains = malloc (count * sizeof (chain_t));
+    if (chains == NULL) {
+        fprintf (stderr, "Out of memory for %lu chains\n", count);
+        exit (EXIT_FAILURE);
+    }
+
+    value_t V[3];
+    V[0] = V[1] = V[2] = DIAG (0);
+    value_t column = DIAG (0);
+    uint64_t blocks[WIDTH];
+    uint64_t starts[WIDTH];
+    for (int i = 0; i != WIDTH; ++i)
+        recharge (V, blocks, starts, 0, i);
+
+    uint64_t done = 0;
+    uint64_t discarded = 0;
+    uint64_t points = 0;
+    while (done < count) {
+        int t = loop_table (V, &column);
+        for (int i = 0; i != WIDTH; ++i) {
+            uint32_t length = EXTRACT (column, i);
+            if (TESTTEST (t, i)) {
+                if (done < count) {
+                    chain_t * c = &chains[done++];
+                    c->h[0] = EXTRACT (V[0], i);
+                    c->h[1] = EXTRACT (V[1], i);
+                    c->h[2] = EXTRACT (V[2], i);
+                    c->length = length;
+                    c->block = blocks[i];
+                    points += length;
+                    if ((done & 0xffff) == 0) {
+                        printf ("%lu chains, %lu points\n", done, points);
+                        fflush (NULL);
+                    }
+                }
+            }
+            else if (length < MAX_CHAIN)
+                continue;
+            else
+                ++discarded;
+            recharge (V, blocks, starts, 0, i);
+            column = INSERT (column, i, 0);
+        }
+        V[2] = XOR (V[2], column);
+    }
+
+    // Sort by end point, and drop duplicates of chains that merged.  Chains
+    // that merely share an end point at different lengths are distinct.
+    qsort (chains, count, sizeof (chain_t), chain_compare);
+    uint64_t kept = 0;
+    for (uint64_t i = 0; i != count; ++i)
+        if (kept == 0 || chain_compare (&chains[kept - 1], &chains[i]) != 0)
+            chains[kept++] = chains[i];
+        else
+            points -= chains[i].length;
+
+    table_header_t header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, table_magic, sizeof (table_magic));
+    header.bits = BITS;
+    header.proportion = PROPORTION;
+    header.encoding = ENCODING;
+    header.max_chain = MAX_CHAIN;
+    header.count = kept;
+
+    if (fwrite (&header, sizeof (header), 1, f) != 1
+        || fwrite (chains, sizeof (chain_t), kept, f) != kept
+        || fclose (f) != 0) {
+        perror (path);
+        exit (EXIT_FAILURE);
+    }
+
+    printf ("Wrote %lu chains (%lu merged, %lu discarded) covering %lu points"
+            " to %s\n", kept, count - kept, discarded, points, path);
+    free (chains);
+}
+
+
+static void truncate_hash (uint32_t h[3])
+{
+    for (int i = 0; i != 3; ++i) {
+        int keep = BITS - 32 * i;
+        if (keep <= 0)
+            h[i] = 0;
+        else if (keep < 32)
+            h[i] &= SWAP (0xffffffff << (32 - keep));
+    }
+}
+
+
+// Parse a hash given as hex digits, in md5sum order.
+static void parse_hash (const char * s, uint32_t h[3])
+{
+    h[0] = h[1] = h[2] = 0;
+    for (int i = 0; s[i]; ++i) {
+        if (i >= 24 || !isxdigit ((unsigned char) s[i])) {
+            fprintf (stderr, "Bad hash %s\n", s);
+            exit (EXIT_FAILURE);
+        }
+        uint32_t nibble = isdigit (s[i]) ? s[i] - '0' : tolower (s[i]) - 'a' + 10;
+        h[i / 8] |= nibble << (i % 8 / 2 * 8 + (i % 2 ? 0 : 4));
+    }
+    truncate_hash (h);
+}
+
+
+static const chain_t * find_chain (const chain_t * chains, uint64_t count,
+                                   const uint32_t h[3], uint32_t length)
+{
+    chain_t key;
+    memcpy (key.h, h, sizeof (key.h));
+    key.length = length;
+    uint64_t low = 0;
+    uint64_t high = count;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        int c = chain_compare (&chains[mid], &key);
+        if (c == 0)
+            return &chains[mid];
+        if (c < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+
+/* Regenerate a chain up to column, and check that it really does hash to
+ * the target there.  */
+static bool check_chain (const chain_t * chain, uint32_t column,
+                         const uint32_t target[3])
+{
+    value_t V[3];
+    V[0] = DIAG (chain->block);
+    V[1] = DIAG (chain->block >> 32);
+    V[2] = DIAG (0);
+    for (uint32_t i = 1; i < column; ++i) {
+        outline_MD5 (V);
+        V[2] = XOR (V[2], DIAG (i));
+    }
+    uint32_t P[3] = { FIRST (V[0]), FIRST (V[1]), FIRST (V[2]) };
+    outline_MD5 (V);
+    if (FIRST (V[0]) != target[0] || FIRST (V[1]) != target[1]
+        || FIRST (V[2]) != target[2])
+        return false;
+
+    uint32_t block[16];
+    message_block (P, block);
+    printf ("Preimage: %.*s -> %08x %08x %08x\n",
+            MESSAGE_CHARS, (const char *) block,
+            SWAP (target[0]), SWAP (target[1]), SWAP (target[2]));
+    return true;
+}
+
+
+static void lookup_table (const char * path, const char * hash)
+{
+    FILE * f = fopen (path, "r");
+    if (f == NULL) {
+        perror (path);
+        exit (EXIT_FAILURE);
+    }
+    table_header_t header;
+    if (fread (&header, sizeof (header), 1, f) != 1
+        || memcmp (header.magic, table_magic, sizeof (table_magic)) != 0) {
+        fprintf (stderr, "%s is not a table\n", path);
+        exit (EXIT_FAILURE);
+    }
+    if (header.bits != BITS || header.proportion != PROPORTION
+        || header.encoding != ENCODING) {
+        fprintf (stderr, "%s is for BITS=%u PROPORTION=%u ENCODING=%u\n",
+                 path, header.bits, header.proportion, header.encoding);
+        exit (EXIT_FAILURE);
+    }
+    chain_t * chains = malloc (header.count * sizeof (chain_t));
+    if (chains == NULL
+        || fread (chains, sizeof (chain_t), header.count, f) != header.count) {
+        fprintf (stderr, "Failed to read %lu chains from %s\n",
+                 header.count, path);
+        exit (EXIT_FAILURE);
+    }
+    fclose (f);
+
+    uint32_t target[3];
+    parse_hash (hash, target);
+    printf ("Looking up %08x %08x %08x in %lu chains\n",
+            SWAP (target[0]), SWAP (target[1]), SWAP (target[2]),
+            header.count);
+    fflush (NULL);
+
+    // A distinguished target can only be the end of a chain.
+    if (distinguished (target[0])) {
+        for (uint32_t length = 1; length < MAX_CHAIN; ++length) {
+            const chain_t * c = find_chain (
+                chains, header.count, target, length);
+            if (c != NULL && check_chain (c, length, target))
+                return;
+        }
+        printf ("No preimage found\n");
+        return;
+    }
+
+    // Otherwise try each column in turn, a lane per column.  starts[i] is
+    // the column that lane i started from, or zero for idle.
+    value_t V[3];
+    V[0] = V[1] = V[2] = DIAG (0);
+    value_t column = DIAG (0);
+    uint32_t starts[WIDTH];
+    uint32_t next = 1;
+    int active = 0;
+    for (int i = 0; i != WIDTH; ++i)
+        starts[i] = 0;
+
+    do {
+        for (int i = 0; i != WIDTH; ++i) {
+            if (starts[i] != 0 || next >= MAX_CHAIN)
+                continue;
+            V[0] = INSERT (V[0], i, target[0]);
+            V[1] = INSERT (V[1], i, target[1]);
+            V[2] = INSERT (V[2], i, target[2] ^ next);
+            column = INSERT (column, i, next);
+            starts[i] = next++;
+            ++active;
+        }
+
+        int t = loop_table (V, &column);
+        for (int i = 0; i != WIDTH; ++i) {
+            if (starts[i] == 0)
+                continue;
+            uint32_t length = EXTRACT (column, i);
+            if (TESTTEST (t, i)) {
+                uint32_t h[3] = {
+                    EXTRACT (V[0], i), EXTRACT (V[1], i), EXTRACT (V[2], i) };
+                const chain_t * c = find_chain (
+                    chains, header.count, h, length);
+                if (c != NULL && check_chain (c, starts[i], target))
+                    return;
+            }
+            else if (length < MAX_CHAIN)
+                continue;
+            starts[i] = 0;
+            --active;
+        }
+        V[2] = XOR (V[2], column);
+    }
+    while (active != 0);
+
+    printf ("No preimage found\n");
+}
+
+
+static void usage (const char * argv0) __attribute__ ((noreturn));
+static void usage (const char * argv0)
+{
+    fprintf (stderr, "Usage: %s [-s <shm name> | -d <spill dir> [-m <records>]]"
+             " [-c <address>] [<block> [<step>]]\n"
+             "       %s -w <address>\n"
+             "       %s -t <table> (-n <chains> | -q <hash>)\n",
+             argv0, argv0, argv0);
+    exit (EXIT_FAILURE);
+}
+
+
 int main (int argc, char ** argv)
 {
-    if (argc > 1)
-        work_block = strtoul (argv[1], NULL, 0);
-    if (argc > 2)
-        work_step = strtoul (argv[2], NULL, 0);
+    const char * table = NULL;
+    const char * query = NULL;
+    uint64_t chains = 0;
+    int opt;
+    const char * coordinate = NULL;
+    const char * work = NULL;
+    const char * spill_dir = NULL;
+    const char * shared = NULL;
+    bool limit = false;
+    while ((opt = getopt (argc, argv, "t:n:q:s:c:w:d:m:")) != -1)
+        switch (opt) {
+        case 'd':
+            spill_dir = optarg;
+            break;
+        case 'm':
+            spill_limit = strtoul (optarg, NULL, 0);
+            limit = true;
+            break;
+        case 'c':
+            coordinate = optarg;
+            break;
+        case 'w':
+            work = optarg;
+            break;
+        case 's':
+            shared = optarg;
+            break;
+        case 't':
+            table = optarg;
+            break;
+        case 'n':
+            chains = strtoul (optarg, NULL, 0);
+            break;
+        case 'q':
+            query = optarg;
+            break;
+        default:
+            usage (argv[0]);
+        }
+
+    // The table modes stand alone; a worker's coordinator keeps the points,
+    // and the shared table is never spilled.
+    bool search = shared || spill_dir || coordinate || work;
+    if ((table != NULL) == (query == NULL && chains == 0)
+        || (table != NULL && (search || argc > optind))
+        || (query != NULL && chains != 0)
+        || (work != NULL && (shared || spill_dir || coordinate
+                             || argc > optind))
+        || (shared != NULL && spill_dir != NULL)
+        || (limit && spill_dir == NULL)
+        || argc > optind + 2)
+        usage (argv[0]);
+
+    if (argc > optind)
+        work_block = strtoul (argv[optind], NULL, 0);
+    if (argc > optind + 1)
+        work_step = strtoul (argv[optind + 1], NULL, 0);
 
     value_t v = DIAG (0);
 
@@ -844,6 +2473,25 @@ int main (int argc, char ** argv)
     assert (v2 == EXTRACT (v, 2));
     assert (v3 == EXTRACT (v, 3));
 
+    check_encoding();
+
+    if (table != NULL && query != NULL) {
+        lookup_table (table, query);
+        return EXIT_SUCCESS;
+    }
+    if (table != NULL) {
+        build_table (table, chains);
+        return EXIT_SUCCESS;
+    }
+    if (shared != NULL)
+        open_shared (shared);
+    if (spill_dir != NULL)
+        start_spill (spill_dir);
+    if (coordinate != NULL)
+        coordinator (coordinate);
+    if (work != NULL)
+        open_worker (work);
+
 /*     pthread_t th; */
 /*     pthread_create (&th, NULL, main_loop, NULL); */
     main_loop (NULL);
@@ -7,25 +7,21 @@
 
 #include "jtag-io.h"
 
-void check (int pipeline)
+// All pipelines are loaded and sampled together, so should agree.
+void check (void)
 {
-    printf ("Check pipeline %c\n", pipeline + 'A');
+    printf ("Check %u pipelines\n", PIPELINES);
     printf ("ID Code is %08x\n", read_id());
 
     uint64_t clock1 = start_clock();
     uint64_t load_clock = clock1 + FREQ / 20;
-    load_md5 (pipeline, load_clock, 0x01234567, 0x78abcdef, 0xfc9639da);
+    load_md5_all (load_clock, 0x01234567, 0x78abcdef, 0xfc9639da);
     usleep (100000);
 
     uint64_t sample_clock = load_clock + (FREQ / 10 / STAGES) * STAGES;
-    sample_md5 (pipeline, sample_clock);
+    sample_md5_all (sample_clock);
     usleep (100000);
 
-    uint32_t sample[3];
-
-    bool got_load = false;
-    bool got_sample = false;
-
     uint64_t clock2 = read_clock();
 
     printf ("Elapsed %lu to %lu [%lu cycles]\n",
@@ -33,48 +29,68 @@ void check (int pipeline)
     printf ("Load %lu, sample %lu [%lu iterations]\n",
             load_clock, sample_clock, (sample_clock - load_clock) / STAGES);
 
-    for (int i = 0; i != 256; ++i) {
-        printf (".");
-        fflush (stdout);
-        uint64_t clock;
-        uint32_t data[3];
-        read_result (pipeline, i, &clock, data);
-        if (clock1 <= clock && clock <= clock2)
-            printf ("\n%12lu %08x %08x %08x [%lu]\n",
-                    clock, data[0], data[1], data[2], clock % STAGES);
-        if (clock == load_clock)
-            got_load = true;
-
-        if (clock == sample_clock) {
-            got_sample = true;
-            memcpy (sample, data, sizeof (data));
-        }
-    }
-    printf ("\n");
-
-    if (!got_load)
-        printf_exit ("Failed to load data\n");
-    if (!got_sample)
-        printf_exit ("Failed to sample data\n");
-
     uint32_t data[3] = { 0x01234567, 0x78abcdef, 0xfc9639da };
     for (uint64_t i = load_clock; i != sample_clock; i += STAGES)
         transform (data, data);
 
     printf ("Calced: %08x %08x %08x\n", data[0], data[1], data[2]);
-    printf ("Sample: %08x %08x %08x\n", sample[0], sample[1], sample[2]);
 
-    if (memcmp (data, sample, sizeof (data)) != 0)
-        printf_exit ("Mismatch\n");
+    // Read each hit ram in one go.
+    read_op_t ops[HIT_DEPTH];
+    for (int pipeline = 0; pipeline != PIPELINES; ++pipeline) {
+        uint32_t sample[3];
+
+        bool got_load = false;
+        bool got_sample = false;
+
+        printf ("Pipeline %c", pipeline + 'A');
+        for (int i = 0; i != HIT_DEPTH; ++i) {
+            ops[i].pipeline = pipeline;
+            ops[i].location = i;
+        }
+        read_batch_raw (ops, HIT_DEPTH);
+        for (int i = 0; i != HIT_DEPTH; ++i) {
+            uint64_t clock = adjust_clock (ops[i].clock);
+            const uint32_t * result = ops[i].data;
+            if (clock1 <= clock && clock <= clock2)
+                printf ("\n%12lu %08x %08x %08x [%lu]\n",
+                        clock, result[0], result[1], result[2],
+                        clock % STAGES);
+            if (clock == load_clock)
+                got_load = true;
+
+            if (clock == sample_clock) {
+                got_sample = true;
+                memcpy (sample, result, sizeof (sample));
+            }
+        }
+        printf ("\n");
+
+        if (!got_load)
+            printf_exit ("Failed to load data\n");
+        if (!got_sample)
+            printf_exit ("Failed to sample data\n");
+
+        printf ("Sample: %08x %08x %08x\n", sample[0], sample[1], sample[2]);
+
+        if (memcmp (data, sample, sizeof (data)) != 0)
+            printf_exit ("Mismatch\n");
+    }
 }
 
 
-int main()
+int main (int argc, char * argv[])
 {
+    if (argc == 3 && strcmp (argv[1], "-g") == 0)
+        parse_geometry (argv[2]);
+    else if (argc != 1)
+        printf_exit ("Usage: %s [-g <geometry>]\n", argv[0]);
+
     open_serial();
+    jtag_reset();
+    read_capabilities();
 
-    check (0);
-    check (1);
+    check();
 
     jtag_reset();
 